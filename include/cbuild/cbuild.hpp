@@ -5,10 +5,14 @@
 #include <vector>
 #include <sstream>
 #include <cstdlib>
+#include <functional>
+#include <filesystem>
 
 #define BUILD_DIR "build/"
 #define CBUILD_DIR BUILD_DIR ".cbuild/"
 #define TEMP_DIR CBUILD_DIR ".temp/"
+#define TEST_DIR CBUILD_DIR ".tests/"
+#define RECORD_DIR CBUILD_DIR ".records/"
 
 #if defined(_WIN32) || defined(_WIN64)
     #define SHARED_LIB_EXT ".dll"
@@ -36,7 +40,33 @@ namespace CBuild {
         std::vector<std::string> includedDirectories;
     };
 
+    enum class CompilerFamily {
+        eUnknown,
+        eGcc,
+        eClang,
+    };
+
+    struct Toolchain {
+        std::string path; // resolved compiler binary, empty when the compiler could not be found
+        std::string hash;
+        CompilerFamily family = CompilerFamily::eUnknown;
+        int major = 0;
+        int minor = 0;
+        int patch = 0;
+        std::string scanner;
+        std::string packager; // dwp tool that can package this compiler's split DWARF
+        std::string linker; // fastest working linker flag, empty for the compiler default
+        std::vector<std::string> linkers;
+        std::vector<std::string> flags;
+
+        bool supports(const std::string& flag) const;
+    };
+
+    Toolchain probeToolchain(const std::string& alias);
+    std::string hashFile(const std::string& path);
+
     struct Compiler {
+        Toolchain toolchain; // filled on first compile when left empty
         std::string alias = "g++";
         std::string inputFlag = ""; 
         std::string outputFlag = "-o"; 
@@ -48,11 +78,85 @@ namespace CBuild {
         std::string standardFlag = "-std=";
         std::string defineFlag = "-D";
         std::string add = "-fPIC -Wall -Werror -Wl,-rpath,'$ORIGIN' -std=c++20";
+        std::string compileFlag = "-c";
+        std::string languageFlag = "-x c++";
+        std::string moduleFlag = "-fmodules-ts";
+        std::string moduleMapperFlag = "-fmodule-mapper=";
+        std::string modulePathFlag = "";
+        std::string moduleOutputFlag = "";
+        std::string moduleFileFlag = "";
+        std::string moduleLanguageFlag = "-x c++";
+        std::string headerUnitFlag = "-fmodule-header=system -x c++-system-header";
+        std::string moduleExtension = ".gcm";
+        std::string scanFlag = "-fdeps-format=p1689r5";
+        std::string scanFileFlag = "-fdeps-file=";
+        std::string scanTargetFlag = "-fdeps-target=";
+        std::string depFileFlag = "-MD -MF ";
+        std::string scanner = ""; // e.g. "clang-scan-deps", empty uses the compiler itself
+        std::string debugFlag = "-g";
+        std::string splitDebugFlag = "-gsplit-dwarf";
+        std::string compressDebugFlag = "-gz";
+        std::string gdbIndexFlag = "-Wl,--gdb-index";
+        std::string compressLinkFlag = "-Wl,--compress-debug-sections=zlib"; // dwp tools cannot read compressed .dwo files
+    };
+
+    enum class DebugInfo {
+        eNone,
+        eFull,     // debug info stays in the objects and is linked into the binary
+        eSplit,    // debug info stays in .dwo files beside the objects, the linker only sees skeletons
+        ePackaged, // eSplit plus a .dwp next to the binary for shipping or copying elsewhere
     };
 
+    Compiler detectCompiler(std::string alias = "g++");
+
     struct CompileOptions {
         Compiler compiler;
         std::string output = "./build";
+        unsigned int jobs = 0; // 0 uses every hardware thread
+        DebugInfo debug = DebugInfo::eNone;
+    };
+
+    struct Job {
+        std::string name; // may be empty when nothing depends on the job
+        std::vector<std::string> after;
+        std::function<int()> run;
+    };
+
+    int runJobs(std::vector<Job>& jobs, unsigned int threads = 0);
+
+    std::vector<std::string> parseDepfile(const std::string& path);
+
+    // what a target was last built from, kept in <output>/.deps/<artifact>.build
+    struct BuildRecord {
+        std::string command;
+        std::string toolchain;
+        double cost = 0; // seconds the last compile took
+        std::vector<std::string> reasons; // why the last compile happened
+        std::vector<std::pair<std::string, std::string>> inputs; // path and hash of the source and headers
+        std::vector<std::pair<std::string, std::string>> dependencies; // path and hash of module objects and libraries
+    };
+
+    BuildRecord readRecord(const std::string& path);
+
+    // where each build record lives, outputs can be anywhere so 'explain' cannot guess
+    struct RecordEntry {
+        std::string artifact;
+        std::string record;
+        bool unit = false; // a module or header unit rather than a linked binary
+    };
+
+    std::vector<RecordEntry> readRecordIndex();
+    std::vector<std::string> changedInputs(const BuildRecord& record, const std::string& artifact);
+
+    // flattens a source or header path into the file name its module cache entries use
+    std::string sanitize(const std::string& path);
+
+    struct ModuleUnit {
+        std::string source;
+        std::string provides; // empty for units that only import
+        std::vector<std::string> imports;
+        std::string object;
+        std::string bmi;
     };
 
     class Binary {
@@ -69,6 +173,8 @@ namespace CBuild {
             void linkDirectory(std::string path);
             void linkLibrary(std::string alias);
             void define(std::string definition);
+            void module(std::string path);
+            void headerUnit(std::string header);
 
             int compile();        
         protected:
@@ -76,11 +182,26 @@ namespace CBuild {
             std::vector<std::string> linkedDirectories;
             std::vector<std::string> includedDirectories;
             std::vector<std::string> definitions;
+            std::vector<std::string> modules;
+            std::vector<std::string> headerUnits;
             std::string entry;
             std::string alias;
             CompileOptions options;
 
             virtual std::string output() { return ""; }
+            virtual std::string artifact() { return ""; }
+            virtual void record() {}
+
+            std::string compileFlags();
+            std::string linkFlags();
+            std::string moduleCache();
+            ModuleUnit scanModule(const std::string& source, const std::string& cache);
+            std::string resolveHeader(const std::string& header, const std::string& cache);
+            int compileModules(std::string& flags, std::vector<std::string>& objects, std::vector<std::string>& headerFiles);
+            std::vector<std::string> dependencies(const std::vector<std::string>& objects);
+            std::vector<std::string> rebuildReasons(const std::string& command, const std::string& state, const std::vector<std::string>& objects);
+            void writeRecord(const std::string& command, const std::string& state, const std::vector<std::string>& objects, std::filesystem::file_time_type started, double cost, const std::vector<std::string>& reasons);
+            int packageDebugInfo();
     };
 
     class Shared : public Binary {
@@ -89,6 +210,7 @@ namespace CBuild {
 
         private:
             std::string output() override;
+            std::string artifact() override;
     };
 
     class Static : public Binary {
@@ -97,6 +219,7 @@ namespace CBuild {
 
         private:
             std::string output() override;
+            std::string artifact() override;
     };
 
     class Executable : public Binary {
@@ -105,6 +228,20 @@ namespace CBuild {
 
         private:
             std::string output() override;
+            std::string artifact() override;
+    };
+
+    // an executable that 'cbuild test' runs, passing when it exits with 0
+    class Test : public Binary {
+        public:
+            // registered before it compiles so a test that fails to build still shows up in 'cbuild test'
+            Test(Context context, std::string entry, std::string alias, CompileOptions options = {}) : Binary(context, entry, alias, options) { registerTest(false); }
+
+        private:
+            std::string output() override;
+            std::string artifact() override;
+            void record() override;
+            void registerTest(bool built);
     };
 }
 
@@ -1,7 +1,13 @@
 #include <cbuild/cbuild.hpp>
 #include <filesystem>
+#include <chrono>
 namespace fs = std::filesystem;
 
+#include "jobs.cpp"
+#include "toolchain.cpp"
+#include "depend.cpp"
+#include "module.cpp"
+
 namespace CBuild {
 
     void Binary::includeDirectory(std::string path) {
@@ -20,13 +26,90 @@ namespace CBuild {
         definitions.push_back(definition);
     }
 
+    std::string Binary::compileFlags() {
+        std::stringstream flags;
+
+        flags << options.compiler.add << " ";
+
+        for (auto& includedDirectory : includedDirectories) {
+            flags << options.compiler.includeDirectoryFlag << includedDirectory << " ";
+        }
+
+        for (auto& definition : definitions) {
+            flags << options.compiler.defineFlag << definition << " ";
+        }
+
+        const Toolchain& toolchain = options.compiler.toolchain;
+
+        if (options.debug != DebugInfo::eNone)
+            flags << options.compiler.debugFlag << " ";
+
+        if ((options.debug == DebugInfo::eSplit || options.debug == DebugInfo::ePackaged) && toolchain.supports(options.compiler.splitDebugFlag))
+            flags << options.compiler.splitDebugFlag << " ";
+
+        // packaged builds compress at link time instead, the packager has to read the .dwo files
+        if (options.debug != DebugInfo::eNone && options.debug != DebugInfo::ePackaged && toolchain.supports(options.compiler.compressDebugFlag))
+            flags << options.compiler.compressDebugFlag << " ";
+
+        return flags.str();
+    }
+
+    std::string Binary::linkFlags() {
+        std::stringstream flags;
+
+        const Toolchain& toolchain = options.compiler.toolchain;
+
+        bool index = options.debug != DebugInfo::eNone && toolchain.supports(options.compiler.gdbIndexFlag);
+        bool compress = options.debug == DebugInfo::ePackaged && toolchain.supports(options.compiler.compressLinkFlag);
+
+        // both were probed with the toolchain's linker, the default one may not know them
+        if ((index || compress) && options.compiler.add.find(toolchain.linker) == std::string::npos)
+            flags << toolchain.linker << " ";
+
+        if (index)
+            flags << options.compiler.gdbIndexFlag << " ";
+
+        if (compress)
+            flags << options.compiler.compressLinkFlag << " ";
+
+        return flags.str();
+    }
+
     int Binary::compile() {
+        std::string moduleFlags;
+        std::vector<std::string> moduleObjects;
+        std::vector<std::string> headerFiles;
+
+        if (options.compiler.toolchain.path.empty())
+            options.compiler.toolchain = probeToolchain(options.compiler.alias);
+
+        if (!modules.empty() || !headerUnits.empty()) {
+            int ret = compileModules(moduleFlags, moduleObjects, headerFiles);
+
+            if (ret)
+                return ret;
+        }
+
+        // the entry reads header unit BMIs without linking them, a rebuilt one still recompiles it
+        std::vector<std::string> moduleFiles = moduleObjects;
+        moduleFiles.insert(moduleFiles.end(), headerFiles.begin(), headerFiles.end());
+
+        // kept beside the outputs but hidden so copyBuild leaves it behind
+        std::string state = options.output + "/.deps/" + fs::path(artifact()).filename().string();
+        fs::create_directories(fs::path(state).parent_path());
+
         std::stringstream command;
         
         command << options.compiler.alias << " ";
         command << options.compiler.inputFlag << entry << " ";
         command << options.compiler.outputFlag << options.output << output() << " ";
-        command << options.compiler.add << " ";
+        command << compileFlags();
+        command << linkFlags();
+        command << moduleFlags;
+
+        for (auto& moduleObject : moduleObjects) {
+            command << moduleObject << " ";
+        }
 
         for (auto& linkedLibrary : linkedLibraries) {
             command << options.compiler.linkLibraryFlag << linkedLibrary << " ";
@@ -36,28 +119,97 @@ namespace CBuild {
             command << options.compiler.linkDirectoryFlag << linkedDirectory << " ";
         }
 
-        for (auto& includedDirectory : includedDirectories) {
-            command << options.compiler.includeDirectoryFlag << includedDirectory << " ";
+        std::vector<std::string> reasons = rebuildReasons(command.str(), state, moduleFiles);
+
+        if (!reasons.empty()) {
+            auto start = std::chrono::steady_clock::now();
+            auto started = fs::file_time_type::clock::now();
+
+            int ret = system((command.str() + options.compiler.depFileFlag + state + ".d").c_str());
+
+            if (ret)
+                return ret;
+
+            double cost = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            writeRecord(command.str(), state, moduleFiles, started, cost, reasons);
         }
 
-        for (auto& definition : definitions) {
-            command << options.compiler.defineFlag << definition << " ";
+        record();
+
+        return options.debug == DebugInfo::ePackaged ? packageDebugInfo() : 0;
+    }
+
+    // checked on every build so switching to ePackaged or deleting the .dwp packages a current binary
+    int Binary::packageDebugInfo() {
+        std::string binary = options.output + artifact();
+        std::string dwp = binary + ".dwp";
+
+        if (fs::exists(dwp) && fs::last_write_time(dwp) >= fs::last_write_time(binary))
+            return 0;
+
+        if (options.compiler.toolchain.packager.empty()) {
+            printf("No dwp packager found, debug info for %s stays in its .dwo files\n", artifact().c_str());
+            return 0;
+        }
+
+        std::stringstream package;
+        package << options.compiler.toolchain.packager << " ";
+        package << "-e " << binary << " ";
+        package << "-o " << dwp;
+
+        int ret = system(package.str().c_str());
+
+        // a stale package would pair old debug info with the new binary
+        if (ret) {
+            printf("Failed to package debug info for %s\n", binary.c_str());
+            fs::remove(dwp);
         }
 
-        int ret = system(command.str().c_str());
-        
         return ret;
     }
 
     std::string Shared::output() {
-        return "/lib" + alias + SHARED_LIB_EXT + " " + options.compiler.sharedFlag;
+        return artifact() + " " + options.compiler.sharedFlag;
+    }
+
+    std::string Shared::artifact() {
+        return "/lib" + alias + SHARED_LIB_EXT;
     }
 
     std::string Static::output() {
-        return "/lib" + alias + STATIC_LIB_EXT + " " + options.compiler.staticFlag;
+        return artifact() + " " + options.compiler.staticFlag;
+    }
+
+    std::string Static::artifact() {
+        return "/lib" + alias + STATIC_LIB_EXT;
     }
 
     std::string Executable::output() {
+        return artifact();
+    }
+
+    std::string Executable::artifact() {
+        return "/" + alias + EXECUTABLE_EXT;
+    }
+
+    std::string Test::output() {
+        return artifact();
+    }
+
+    std::string Test::artifact() {
         return "/" + alias + EXECUTABLE_EXT;
     }
+
+    void Test::record() {
+        registerTest(true);
+    }
+
+    void Test::registerTest(bool built) {
+        fs::create_directories(TEST_DIR);
+
+        std::ofstream entry(fs::path(TEST_DIR) / alias);
+        entry << fs::absolute(options.output + artifact()).lexically_normal().string() << "\n";
+        entry << (built ? "built" : "unbuilt") << "\n";
+    }
 }
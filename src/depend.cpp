@@ -0,0 +1,325 @@
+#include <cbuild/cbuild.hpp>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+namespace fs = std::filesystem;
+
+namespace CBuild {
+
+    // returns the prerequisites of the first rule in a make style depfile
+    std::vector<std::string> parseDepfile(const std::string& path) {
+        std::vector<std::string> inputs;
+        std::ifstream file(path);
+        std::string line;
+        std::string rule;
+
+        // the rule's targets may already wrap, gcc lists the object and BMI of a module unit
+        while (std::getline(file, line)) {
+            bool continued = !line.empty() && line.back() == '\\';
+
+            if (continued)
+                line.pop_back();
+
+            rule += line + " ";
+
+            if (!continued)
+                break;
+        }
+
+        size_t colon = rule.find(": ");
+
+        if (colon == std::string::npos)
+            return inputs;
+
+        std::stringstream tokens(rule.substr(colon + 2));
+        std::string token;
+        std::string input;
+
+        // make escapes a space in a path as '\ ' and a dollar as '$$'
+        while (tokens >> token) {
+            bool escaped = token.back() == '\\';
+
+            if (escaped)
+                token.back() = ' ';
+
+            for (size_t pos = 0; (pos = token.find("$$", pos)) != std::string::npos; pos++)
+                token.erase(pos, 1);
+
+            input += token;
+
+            if (!escaped) {
+                inputs.push_back(input);
+                input.clear();
+            }
+        }
+
+        return inputs;
+    }
+
+    // most headers are shared by many targets so each is hashed once per timestamp
+    static std::string hashInput(const std::string& path) {
+        static std::mutex mutex;
+        static std::unordered_map<std::string, std::pair<fs::file_time_type, std::string>> hashes;
+
+        auto time = fs::last_write_time(path);
+
+        std::lock_guard<std::mutex> guard(mutex);
+
+        auto it = hashes.find(path);
+
+        if (it != hashes.end() && it->second.first == time)
+            return it->second.second;
+
+        std::string hash = hashFile(path);
+        hashes[path] = {time, hash};
+
+        return hash;
+    }
+
+    static std::string toolchainId(const Toolchain& toolchain) {
+        std::stringstream id;
+        id << toolchain.path << " " << toolchain.major << "." << toolchain.minor << "." << toolchain.patch << " " << toolchain.hash;
+        return id.str();
+    }
+
+    static std::string flagDifference(const std::string& previous, const std::string& current) {
+        std::stringstream previousStream(previous), currentStream(current);
+        std::vector<std::string> previousFlags, currentFlags;
+        std::string token;
+
+        while (previousStream >> token)
+            previousFlags.push_back(token);
+
+        while (currentStream >> token)
+            currentFlags.push_back(token);
+
+        std::string added, removed;
+
+        for (auto& flag : currentFlags) {
+            if (std::find(previousFlags.begin(), previousFlags.end(), flag) == previousFlags.end())
+                added += " " + flag;
+        }
+
+        for (auto& flag : previousFlags) {
+            if (std::find(currentFlags.begin(), currentFlags.end(), flag) == currentFlags.end())
+                removed += " " + flag;
+        }
+
+        if (added.empty() && removed.empty())
+            return "flags were reordered";
+
+        std::string difference = "flags changed";
+
+        if (!added.empty())
+            difference += ", added" + added;
+
+        if (!removed.empty())
+            difference += ", removed" + removed;
+
+        return difference;
+    }
+
+    BuildRecord readRecord(const std::string& path) {
+        BuildRecord record;
+        std::ifstream file(path);
+        std::string line;
+
+        while (std::getline(file, line)) {
+            size_t split = line.find('=');
+
+            if (split == std::string::npos)
+                continue;
+
+            std::string key = line.substr(0, split);
+            std::string value = line.substr(split + 1);
+
+            if (key == "command") {
+                record.command = value;
+            } else if (key == "toolchain") {
+                record.toolchain = value;
+            } else if (key == "cost") {
+                record.cost = atof(value.c_str());
+            } else if (key == "reason") {
+                record.reasons.push_back(value);
+            } else if (key == "input" || key == "dependency") {
+                size_t space = value.find(' ');
+
+                if (space == std::string::npos)
+                    continue;
+
+                auto& entries = key == "input" ? record.inputs : record.dependencies;
+                entries.push_back({value.substr(space + 1), value.substr(0, space)});
+            }
+        }
+
+        return record;
+    }
+
+    // one file per record, named by its path, so parallel jobs never write the same entry
+    static void indexRecord(const std::string& artifact, const std::string& state, bool unit) {
+        std::string record = fs::absolute(state + ".build").lexically_normal().string();
+
+        std::stringstream name;
+        name << std::hex << std::hash<std::string>{}(record);
+
+        fs::create_directories(RECORD_DIR);
+
+        std::ofstream entry(fs::path(RECORD_DIR) / name.str());
+        entry << "artifact=" << fs::absolute(artifact).lexically_normal().string() << "\n";
+        entry << "record=" << record << "\n";
+        entry << "unit=" << unit << "\n";
+    }
+
+    std::vector<RecordEntry> readRecordIndex() {
+        std::vector<RecordEntry> entries;
+
+        if (!fs::exists(RECORD_DIR))
+            return entries;
+
+        for (auto& file : fs::directory_iterator(RECORD_DIR)) {
+            std::ifstream stream(file.path());
+            std::string line;
+            RecordEntry entry;
+
+            while (std::getline(stream, line)) {
+                size_t split = line.find('=');
+
+                if (split == std::string::npos)
+                    continue;
+
+                std::string key = line.substr(0, split);
+                std::string value = line.substr(split + 1);
+
+                if (key == "artifact")
+                    entry.artifact = value;
+                else if (key == "record")
+                    entry.record = value;
+                else if (key == "unit")
+                    entry.unit = value == "1";
+            }
+
+            // outputs that were cleaned away leave their entries behind
+            if (fs::exists(entry.record))
+                entries.push_back(entry);
+        }
+
+        return entries;
+    }
+
+    std::vector<std::string> changedInputs(const BuildRecord& record, const std::string& artifact) {
+        std::vector<std::string> changes;
+
+        bool built = fs::exists(artifact);
+        fs::file_time_type builtTime = built ? fs::last_write_time(artifact) : fs::file_time_type();
+
+        auto check = [&](const std::vector<std::pair<std::string, std::string>>& entries, const std::string& kind) {
+            for (auto& [path, hash] : entries) {
+                if (!fs::exists(path)) {
+                    changes.push_back(kind + path + " was removed");
+                    continue;
+                }
+
+                // content is only hashed once the timestamp says it may have changed, an empty hash always has
+                if (built && !hash.empty() && fs::last_write_time(path) <= builtTime)
+                    continue;
+
+                if (hashInput(path) != hash)
+                    changes.push_back(kind + path + " changed");
+            }
+        };
+
+        check(record.inputs, "");
+        check(record.dependencies, "dependency ");
+
+        return changes;
+    }
+
+    std::vector<std::string> Binary::dependencies(const std::vector<std::string>& objects) {
+        std::vector<std::string> found = objects;
+
+        // libraries from outside the linked directories are treated as part of the system
+        for (auto& linkedLibrary : linkedLibraries) {
+            for (auto& linkedDirectory : linkedDirectories) {
+                for (auto extension : {SHARED_LIB_EXT, STATIC_LIB_EXT}) {
+                    fs::path library = fs::path(linkedDirectory) / ("lib" + linkedLibrary + extension);
+
+                    if (fs::exists(library))
+                        found.push_back(library.string());
+                }
+            }
+        }
+
+        return found;
+    }
+
+    // shared by binaries and module units, nothing returned means the artifact is current
+    static std::vector<std::string> recordReasons(const std::string& artifact, const std::string& state, const std::string& command, const std::string& toolchain, const std::vector<std::string>& dependencies) {
+        if (!fs::exists(artifact))
+            return {artifact + " does not exist"};
+
+        BuildRecord record = readRecord(state + ".build");
+
+        if (record.command.empty())
+            return {"no previous build was recorded"};
+
+        std::vector<std::string> reasons;
+
+        if (record.toolchain != toolchain)
+            reasons.push_back("toolchain changed from '" + record.toolchain + "' to '" + toolchain + "'");
+
+        if (record.command != command)
+            reasons.push_back(flagDifference(record.command, command));
+
+        std::unordered_set<std::string> known;
+
+        for (auto& [path, hash] : record.dependencies)
+            known.insert(path);
+
+        for (auto& dependency : dependencies) {
+            if (known.find(dependency) == known.end())
+                reasons.push_back("dependency " + dependency + " was added");
+        }
+
+        std::vector<std::string> changes = changedInputs(record, artifact);
+        reasons.insert(reasons.end(), changes.begin(), changes.end());
+
+        return reasons;
+    }
+
+    static void writeRecordFile(const std::string& state, const std::string& command, const std::string& toolchain, fs::file_time_type started, double cost, const std::vector<std::string>& reasons, const std::vector<std::string>& dependencies) {
+        std::ofstream file(state + ".build");
+
+        file << "command=" << command << "\n";
+        file << "toolchain=" << toolchain << "\n";
+        file << "cost=" << cost << "\n";
+
+        for (auto& reason : reasons)
+            file << "reason=" << reason << "\n";
+
+        for (auto& input : parseDepfile(state + ".d")) {
+            if (!fs::exists(input))
+                continue;
+
+            // edited while compiling, the artifact may hold either version so its hash is left empty
+            if (fs::last_write_time(input) > started)
+                file << "input= " << input << "\n";
+            else
+                file << "input=" << hashInput(input) << " " << input << "\n";
+        }
+
+        for (auto& dependency : dependencies)
+            file << "dependency=" << hashInput(dependency) << " " << dependency << "\n";
+    }
+
+    std::vector<std::string> Binary::rebuildReasons(const std::string& command, const std::string& state, const std::vector<std::string>& objects) {
+        return recordReasons(options.output + artifact(), state, command, toolchainId(options.compiler.toolchain), dependencies(objects));
+    }
+
+    void Binary::writeRecord(const std::string& command, const std::string& state, const std::vector<std::string>& objects, fs::file_time_type started, double cost, const std::vector<std::string>& reasons) {
+        writeRecordFile(state, command, toolchainId(options.compiler.toolchain), started, cost, reasons, dependencies(objects));
+        indexRecord(options.output + artifact(), state, false);
+    }
+}
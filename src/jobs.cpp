@@ -0,0 +1,105 @@
+#include <cbuild/cbuild.hpp>
+#include <cstdio>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <algorithm>
+
+namespace CBuild {
+
+    int runJobs(std::vector<Job>& jobs, unsigned int threads) {
+
+        if (threads == 0)
+            threads = std::max(1u, std::thread::hardware_concurrency());
+
+        threads = std::min<size_t>(threads, jobs.size());
+
+        // counts the jobs behind each name that have not finished yet
+        std::unordered_map<std::string, size_t> unfinished;
+
+        for (auto& job : jobs) {
+            if (!job.name.empty())
+                unfinished[job.name]++;
+        }
+
+        std::vector<bool> started(jobs.size(), false);
+        std::mutex mutex;
+        std::condition_variable changed;
+        size_t running = 0;
+        size_t remaining = jobs.size();
+        int result = 0;
+
+        auto isReady = [&](const Job& job) {
+            for (auto& dependency : job.after) {
+                auto it = unfinished.find(dependency);
+
+                if (it != unfinished.end() && it->second > 0)
+                    return false;
+            }
+
+            return true;
+        };
+
+        auto worker = [&]() {
+            std::unique_lock<std::mutex> guard(mutex);
+
+            while (true) {
+                size_t next = jobs.size();
+
+                // jobs are picked in the order given so callers control priority
+                if (result == 0) {
+                    for (size_t i = 0; i < jobs.size(); i++) {
+                        if (!started[i] && isReady(jobs[i])) {
+                            next = i;
+                            break;
+                        }
+                    }
+                }
+
+                if (next == jobs.size()) {
+                    if (running > 0) {
+                        changed.wait(guard);
+                        continue;
+                    }
+
+                    if (result == 0 && remaining > 0) {
+                        printf("Dependency cycle between jobs\n");
+                        result = -1;
+                    }
+
+                    changed.notify_all();
+                    return;
+                }
+
+                started[next] = true;
+                running++;
+
+                guard.unlock();
+                int ret = jobs[next].run();
+                guard.lock();
+
+                running--;
+                remaining--;
+
+                if (!jobs[next].name.empty())
+                    unfinished[jobs[next].name]--;
+
+                if (ret != 0 && result == 0)
+                    result = ret;
+
+                changed.notify_all();
+            }
+        };
+
+        std::vector<std::thread> workers;
+
+        for (unsigned int i = 0; i < threads; i++)
+            workers.emplace_back(worker);
+
+        for (auto& thread : workers)
+            thread.join();
+
+        return result;
+    }
+}
@@ -2,9 +2,12 @@
 
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <sstream>
 #include <filesystem>
 #include <chrono>
+#include <algorithm>
+#include <limits>
 
 #include <cbuild/cbuild.hpp>
 #include <toml++/toml.hpp>
@@ -15,6 +18,9 @@ enum class Action {
     eHelp,
     eBuild,
     eRun,
+    eTest,
+    eExplain,
+    eAnalyze,
     eInstall,
     eClean,
     eInit,
@@ -24,12 +30,15 @@ namespace fs = std::filesystem;
 namespace clk = std::chrono;
 using ParsedToml = toml::v3::ex::parse_result;
 
-void build(fs::path);
+int build(fs::path);
 
 std::unordered_map<std::string, Action> actionMap = {
     {"help",    Action::eHelp},
     {"build",   Action::eBuild},
     {"run",     Action::eRun},
+    {"test",    Action::eTest},
+    {"explain", Action::eExplain},
+    {"analyze", Action::eAnalyze},
     {"clean",   Action::eClean},
     {"install", Action::eInstall},
     {"init",    Action::eInit},
@@ -41,6 +50,11 @@ void listHelp() {
         "\thelp    - provides a list of commands\n"
         "\tbuild   - runs the project's build script\n"
         "\trun     - runs the project's build script then the routine outlined in the 'cbuild.toml'\n"
+        "\ttest    - builds the project then runs its tests in parallel\n"
+        "\t          '--shard i/n' runs the i-th (from 0) of n slices, '-j n' sets the job count\n"
+        "\texplain - shows why a target was last rebuilt and which of its inputs changed since\n"
+        "\tanalyze - 'analyze includes' ranks headers by the compile time their edits invalidate\n"
+        "\t          '--system' keeps headers from outside the project, '-n count' limits the list\n"
         "\tclean   - cleans the project\n"
         "\tinstall - installs a package from the web\n"
         "\tinit    - creates a cbuild.toml and a build.cpp\n"
@@ -78,7 +92,14 @@ void copyBuild(const fs::path& from, const fs::path& to, bool libOnly = false) {
         if (filename.string()[0] == '.')
             continue;
 
-        if (libOnly && !fs::is_directory(entry.status()) &&
+        // debuggers find .dwo files through the compile directory recorded in the binary, they never move
+        if (filename.extension() == ".dwo")
+            continue;
+
+        // a package only travels with the library it belongs to
+        bool debugPackage = filename.extension() == ".dwp" && filename.stem().extension() == SHARED_LIB_EXT;
+
+        if (libOnly && !fs::is_directory(entry.status()) && !debugPackage &&
             (filename.extension() != SHARED_LIB_EXT &&
              filename.extension() != STATIC_LIB_EXT &&
              filename.extension() != ".spv"))
@@ -93,7 +114,7 @@ void copyBuild(const fs::path& from, const fs::path& to, bool libOnly = false) {
                 fs::remove(dest);
         } else if (fs::is_regular_file(entry.status())) {
             fs::create_directories(dest.parent_path());
-            fs::copy_file(entry.path(), dest, fs::copy_options::overwrite_existing);
+            fs::copy_file(entry.path(), dest, fs::copy_options::update_existing);
         }
     }
 
@@ -196,7 +217,8 @@ int64_t lastEdit(fs::path root) {
     return sctp.time_since_epoch().count();
 }
 
-void build(fs::path root = "./", std::unordered_map<std::string, PackageData> packages = {}) {
+// returns non-zero when a package, the build script or the script itself fails
+int build(fs::path root = "./", std::unordered_map<std::string, PackageData> packages = {}) {
 
     makeDirectory(root / BUILD_DIR);
     makeDirectory(root / CBUILD_DIR);
@@ -210,7 +232,7 @@ void build(fs::path root = "./", std::unordered_map<std::string, PackageData> pa
     CBuild::Context mainContext;
 
     if (!fs::exists(root / ".packages.toml"))
-        return;
+        return 0;
 
     ParsedToml packagesToml = toml::parse_file((root / ".packages.toml").string());
 
@@ -250,7 +272,12 @@ void build(fs::path root = "./", std::unordered_map<std::string, PackageData> pa
         }
 
         if (!packOpt.nobuild) {
-            build(packageRoot, packages);
+            int ret = build(packageRoot, packages);
+
+            if (ret) {
+                printf("Failed to build %s\n", name.c_str());
+                return ret;
+            }
 
             if (packOpt.target == "main") 
                 copyBuild(packageRoot / BUILD_DIR, root / BUILD_DIR, true);
@@ -273,7 +300,7 @@ void build(fs::path root = "./", std::unordered_map<std::string, PackageData> pa
 
     if (!fs::exists(root / "build.cpp")) {
         printf("No 'build.cpp' found in project\n");
-        exit(0);
+        return 1;
     }
 
     CBuild::Shared build(
@@ -287,30 +314,39 @@ void build(fs::path root = "./", std::unordered_map<std::string, PackageData> pa
 
     build.linkDirectory(CBUILD_DIR);
 
-    build.compile();
+    if (build.compile()) {
+        printf("Failed to compile build script\n");
+        return 1;
+    }
 
     void* handle = loadLibrary((root / fs::path(CBUILD_DIR) / "libbuild" SHARED_LIB_EXT).c_str());
 
     if (!handle) {
         printf("Failed to load build shared library\n");
-        exit(0);
+        return 1;
     }
 
     int (*buildFunc)(CBuild::Context context) = (int (*)(CBuild::Context))getFunctionFromLibrary(handle, "build");
 
     if (!buildFunc) {
         printf("Failed to load build function\n");
-        exit(0);
+        freeLibrary(handle);
+        return 1;
     }
 
     mainContext.linkedDirectories.push_back(BUILD_DIR);
 
     fs::path current = fs::current_path();
     fs::current_path(root);
-    buildFunc(mainContext);
+    int ret = buildFunc(mainContext);
     fs::current_path(current);
 
     freeLibrary(handle);
+
+    if (ret)
+        printf("Build script returned %d\n", ret);
+
+    return ret;
 }
 
 void clean() {
@@ -370,7 +406,8 @@ void init() {
 }
 
 void run(std::string target) {
-    build();
+    if (build())
+        return;
 
     printf("Running %s\n", target.c_str());
 
@@ -393,6 +430,295 @@ void run(std::string target) {
     freeLibrary(handle);
 }
 
+struct TestRun {
+    std::string name;
+    fs::path path;
+    int64_t built;
+    double expected = std::numeric_limits<double>::infinity();
+    double duration = 0;
+    bool passed = false;
+};
+
+int test(int argc, char* argv[]) {
+    size_t shard = 0;
+    size_t shards = 1;
+    unsigned int jobs = 0;
+
+    for (int i = 2; i < argc; i++) {
+        std::string option = argv[i];
+
+        if (option == "--shard" && i + 1 < argc) {
+            if (sscanf(argv[++i], "%zu/%zu", &shard, &shards) != 2 || shard >= shards) {
+                printf("Invalid shard '%s' expected i/n with i < n\n", argv[i]);
+                return 1;
+            }
+        } else if (option == "-j" && i + 1 < argc) {
+            jobs = atoi(argv[++i]);
+        } else {
+            printf("Invalid test option '%s'\n", option.c_str());
+            return 1;
+        }
+    }
+
+    // every Test target registers itself again while building
+    fs::remove_all(TEST_DIR);
+
+    // a script that stops early never registers its tests, so a failed build fails the run
+    if (build())
+        return 1;
+
+    if (!fs::exists(TEST_DIR)) {
+        printf("No tests found\n");
+        return 0;
+    }
+
+    std::vector<std::string> names;
+
+    for (auto& entry : fs::directory_iterator(TEST_DIR)) {
+        if (entry.path().extension() != ".log")
+            names.push_back(entry.path().filename().string());
+    }
+
+    // sharding only looks at names so every machine agrees on the split
+    std::sort(names.begin(), names.end());
+
+    fs::path resultsPath = fs::path(CBUILD_DIR) / ".tests.toml";
+
+    if (!fs::exists(resultsPath))
+        std::ofstream file(resultsPath);
+
+    ParsedToml results = toml::parse_file(resultsPath.string());
+
+    std::vector<TestRun> runs;
+    size_t unbuilt = 0;
+    size_t cached = 0;
+
+    for (size_t i = shard; i < names.size(); i += shards) {
+        TestRun run;
+        run.name = names[i];
+
+        std::ifstream entry(fs::path(TEST_DIR) / run.name);
+        std::string path, status;
+        std::getline(entry, path);
+        std::getline(entry, status);
+        run.path = path;
+
+        // an old binary may still be on disk, running it would hide the build failure
+        if (status != "built" || !fs::exists(run.path)) {
+            printf("Failed %s (did not build)\n", run.name.c_str());
+            unbuilt++;
+            continue;
+        }
+
+        run.built = fs::last_write_time(run.path).time_since_epoch().count();
+
+        if (results.find(run.name) != results.end()) {
+            auto previous = results[run.name];
+
+            // a passing result holds until the binary is rebuilt
+            if (previous["passed"].as_boolean()->get() && previous["built"].as_integer()->get() == run.built) {
+                cached++;
+                continue;
+            }
+
+            run.expected = previous["duration"].as_floating_point()->get();
+        }
+
+        runs.push_back(run);
+    }
+
+    // longest first so the slowest test never starts last, unknown durations count as longest
+    std::stable_sort(runs.begin(), runs.end(), [](const TestRun& a, const TestRun& b) {
+        return a.expected > b.expected;
+    });
+
+    std::vector<CBuild::Job> testJobs;
+
+    for (auto& run : runs) {
+        testJobs.push_back(CBuild::Job{"", {}, [&run]() {
+            fs::path log = fs::path(TEST_DIR) / (run.name + ".log");
+            std::string command = run.path.string() + " > " + log.string() + " 2>&1";
+
+            auto start = clk::steady_clock::now();
+            run.passed = system(command.c_str()) == 0;
+            run.duration = clk::duration<double>(clk::steady_clock::now() - start).count();
+
+            printf("%s %s (%.2fs)\n", run.passed ? "Passed" : "Failed", run.name.c_str(), run.duration);
+
+            return 0;
+        }});
+    }
+
+    CBuild::runJobs(testJobs, jobs);
+
+    size_t failed = unbuilt;
+
+    for (auto& run : runs) {
+        results.insert_or_assign(run.name, toml::table{
+            {"duration", run.duration},
+            {"passed", run.passed},
+            {"built", run.built},
+        });
+
+        if (run.passed)
+            continue;
+
+        failed++;
+
+        std::ifstream log(fs::path(TEST_DIR) / (run.name + ".log"));
+        printf("\n---- %s ----\n%s\n", run.name.c_str(), std::string(std::istreambuf_iterator<char>(log), {}).c_str());
+    }
+
+    std::ofstream resultsFile(resultsPath);
+    resultsFile << results;
+    resultsFile.close();
+
+    printf("%zu passed, %zu failed, %zu cached\n", runs.size() + unbuilt - failed, failed, cached);
+
+    return failed ? 1 : 0;
+}
+
+// each flag set keeps its own module cache, units no current binary depends on are left over from older flags
+std::vector<CBuild::RecordEntry> currentRecords() {
+    std::vector<CBuild::RecordEntry> entries = CBuild::readRecordIndex();
+    std::unordered_set<std::string> used;
+
+    for (auto& entry : entries) {
+        if (entry.unit)
+            continue;
+
+        for (auto& [path, hash] : CBuild::readRecord(entry.record).dependencies)
+            used.insert(fs::absolute(path).lexically_normal().string());
+    }
+
+    std::vector<CBuild::RecordEntry> current;
+
+    for (auto& entry : entries) {
+        if (!entry.unit || used.find(entry.artifact) != used.end())
+            current.push_back(entry);
+    }
+
+    return current;
+}
+
+int explain(std::string target) {
+    std::vector<std::string> candidates = {
+        target,
+        "lib" + target + SHARED_LIB_EXT,
+        "lib" + target + STATIC_LIB_EXT,
+        target + EXECUTABLE_EXT,
+        CBuild::sanitize(target) + ".o",
+    };
+
+    bool found = false;
+
+    for (auto& entry : currentRecords()) {
+        fs::path artifact = entry.artifact;
+
+        if (std::find(candidates.begin(), candidates.end(), artifact.filename().string()) == candidates.end() && artifact != fs::absolute(target).lexically_normal())
+            continue;
+
+        found = true;
+
+        CBuild::BuildRecord record = CBuild::readRecord(entry.record);
+
+        printf("%s\n", artifact.lexically_relative(fs::current_path()).c_str());
+        printf("  last compiled in %.2fs because\n", record.cost);
+
+        for (auto& reason : record.reasons)
+            printf("    %s\n", reason.c_str());
+
+        std::vector<std::string> changes = CBuild::changedInputs(record, artifact.string());
+
+        // flag and toolchain changes only show up while the build script runs
+        if (changes.empty()) {
+            printf("  none of its %zu inputs changed since\n", record.inputs.size() + record.dependencies.size());
+        } else {
+            printf("  the next build recompiles it because\n");
+
+            for (auto& change : changes)
+                printf("    %s\n", change.c_str());
+        }
+    }
+
+    if (!found) {
+        printf("No build record for '%s', build it first\n", target.c_str());
+        return 1;
+    }
+
+    return 0;
+}
+
+struct HeaderFanout {
+    std::string path;
+    size_t units = 0;
+    double cost = 0;
+};
+
+int analyzeIncludes(int argc, char* argv[]) {
+    bool includeSystem = false;
+    size_t limit = 20;
+
+    for (int i = 3; i < argc; i++) {
+        std::string option = argv[i];
+
+        if (option == "--system") {
+            includeSystem = true;
+        } else if (option == "-n" && i + 1 < argc) {
+            limit = atoi(argv[++i]);
+        } else {
+            printf("Invalid analyze option '%s'\n", option.c_str());
+            return 1;
+        }
+    }
+
+    std::string project = fs::current_path().string() + "/";
+    std::unordered_map<std::string, HeaderFanout> headers;
+    size_t units = 0;
+
+    for (auto& entry : currentRecords()) {
+        CBuild::BuildRecord record = CBuild::readRecord(entry.record);
+        units++;
+
+        // the first input is the translation unit itself
+        for (size_t i = 1; i < record.inputs.size(); i++) {
+            const std::string& path = record.inputs[i].first;
+
+            if (!includeSystem && fs::path(path).is_absolute() && path.rfind(project, 0) != 0)
+                continue;
+
+            HeaderFanout& fanout = headers[path];
+            fanout.path = path;
+            fanout.units++;
+            fanout.cost += record.cost;
+        }
+    }
+
+    if (units == 0) {
+        printf("No build records found, build the project first\n");
+        return 1;
+    }
+
+    std::vector<HeaderFanout> ranked;
+
+    for (auto& [path, fanout] : headers)
+        ranked.push_back(fanout);
+
+    // an edit to a header recompiles every unit that includes it, so its cost is their summed compile time
+    std::sort(ranked.begin(), ranked.end(), [](const HeaderFanout& a, const HeaderFanout& b) {
+        return a.cost != b.cost ? a.cost > b.cost : a.units > b.units;
+    });
+
+    printf("%10s %6s  %s\n", "cost (s)", "units", "header");
+
+    for (size_t i = 0; i < ranked.size() && i < limit; i++)
+        printf("%10.2f %6zu  %s\n", ranked[i].cost, ranked[i].units, ranked[i].path.c_str());
+
+    printf("%zu headers across %zu units\n", ranked.size(), units);
+
+    return 0;
+}
+
 int main(int argc, char* argv[]) {
 
     if (argc < 2) {
@@ -412,7 +738,8 @@ int main(int argc, char* argv[]) {
             listHelp();
         } break;
         case Action::eBuild: {
-            build();
+            // scripts often return a raw system() status, which would wrap to 0 as an exit code
+            return build() ? 1 : 0;
         } break;
         case Action::eRun: {
             if (argc < 3) {
@@ -422,6 +749,23 @@ int main(int argc, char* argv[]) {
             std::string target = argv[2];
             run(target);
         } break;
+        case Action::eTest: {
+            return test(argc, argv);
+        } break;
+        case Action::eExplain: {
+            if (argc < 3) {
+                printf("Missing explain target\n");
+                return 0;
+            }
+            return explain(argv[2]);
+        } break;
+        case Action::eAnalyze: {
+            if (argc < 3 || std::string(argv[2]) != "includes") {
+                printf("Expected 'cbuild analyze includes'\n");
+                return 0;
+            }
+            return analyzeIncludes(argc, argv);
+        } break;
         case Action::eClean: {
             clean();
         } break;
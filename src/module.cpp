@@ -0,0 +1,395 @@
+#include <cbuild/cbuild.hpp>
+#include <filesystem>
+#include <fstream>
+#include <unordered_map>
+#include <algorithm>
+#include <chrono>
+namespace fs = std::filesystem;
+
+namespace CBuild {
+
+    std::string sanitize(const std::string& path) {
+        std::string name = path;
+
+        for (char& c : name) {
+            if (c == '/' || c == '\\' || c == '.' || c == ':' || c == '<' || c == '>')
+                c = '_';
+        }
+
+        return name;
+    }
+
+    // BMI names follow the module name so clang can find them by path, partitions use '-'
+    static std::string moduleFileName(const std::string& name) {
+        std::string file = name;
+        std::replace(file.begin(), file.end(), ':', '-');
+        return file;
+    }
+
+    static std::string readFile(const std::string& path) {
+        std::ifstream file(path);
+        std::stringstream contents;
+        contents << file.rdbuf();
+        return contents.str();
+    }
+
+    static std::string trim(const std::string& str) {
+        size_t start = str.find_first_not_of(" \t\r\n");
+
+        if (start == std::string::npos)
+            return "";
+
+        size_t end = str.find_last_not_of(" \t\r\n");
+        return str.substr(start, end - start + 1);
+    }
+
+    static bool isNewer(const std::string& target, const std::string& than) {
+        return fs::exists(target) && fs::exists(than) && fs::last_write_time(target) >= fs::last_write_time(than);
+    }
+
+    // collects every "logical-name" inside the P1689 array stored under key
+    static std::vector<std::string> logicalNames(const std::string& json, const std::string& key) {
+        std::vector<std::string> names;
+
+        size_t start = json.find("\"" + key + "\"");
+
+        if (start == std::string::npos)
+            return names;
+
+        size_t end = json.find(']', start);
+        size_t pos = start;
+
+        while ((pos = json.find("\"logical-name\"", pos)) != std::string::npos && pos < end) {
+            size_t open = json.find('"', json.find(':', pos) + 1);
+            size_t close = json.find('"', open + 1);
+
+            std::string name = json.substr(open + 1, close - open - 1);
+
+            // header units are built before any named module so they never order anything
+            if (name.find_first_of("/\\<\"") == std::string::npos)
+                names.push_back(name);
+
+            pos = close;
+        }
+
+        return names;
+    }
+
+    static bool parseP1689(const std::string& json, ModuleUnit& unit) {
+        if (json.find("\"rules\"") == std::string::npos)
+            return false;
+
+        std::vector<std::string> provides = logicalNames(json, "provides");
+
+        if (!provides.empty())
+            unit.provides = provides[0];
+
+        unit.imports = logicalNames(json, "requires");
+
+        return true;
+    }
+
+    // fallback for compilers that cannot emit P1689, only understands one declaration per line
+    static void scanSource(const std::string& source, ModuleUnit& unit) {
+        std::ifstream file(source);
+        std::string line;
+        std::string primary;
+
+        while (std::getline(file, line)) {
+            line = trim(line.substr(0, line.find("//")));
+
+            bool exported = line.rfind("export ", 0) == 0;
+
+            if (exported)
+                line = trim(line.substr(7));
+
+            if (line.empty() || line.back() != ';')
+                continue;
+
+            line = trim(line.substr(0, line.size() - 1));
+
+            if (line.rfind("module ", 0) == 0) {
+                std::string name = trim(line.substr(7));
+                primary = name.substr(0, name.find(':'));
+
+                if (exported || name.find(':') != std::string::npos)
+                    unit.provides = name;
+                else
+                    unit.imports.push_back(name);
+
+            } else if (line.rfind("import ", 0) == 0) {
+                std::string name = trim(line.substr(7));
+
+                if (name.empty() || name[0] == '<' || name[0] == '"')
+                    continue;
+
+                if (name[0] == ':')
+                    name = primary + name;
+
+                unit.imports.push_back(name);
+            }
+        }
+    }
+
+    // the depfile and build record sit beside the output so 'explain' can find them
+    static int compileUnit(const std::string& output, const std::string& command, const std::string& depFileFlag, const std::string& toolchain, const std::vector<std::string>& dependencies, const std::vector<std::string>& reasons) {
+        auto start = std::chrono::steady_clock::now();
+        auto started = fs::file_time_type::clock::now();
+
+        int ret = system((command + " " + depFileFlag + output + ".d").c_str());
+
+        if (ret)
+            return ret;
+
+        double cost = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        writeRecordFile(output, command, toolchain, started, cost, reasons, dependencies);
+        indexRecord(output, output, true);
+
+        return 0;
+    }
+
+    void Binary::module(std::string path) {
+        modules.push_back(path);
+    }
+
+    void Binary::headerUnit(std::string header) {
+        headerUnits.push_back(header);
+    }
+
+    std::string Binary::moduleCache() {
+        std::string key = options.compiler.alias + " " + toolchainId(options.compiler.toolchain) + " " + compileFlags() + options.compiler.moduleFlag;
+
+        // BMIs are only valid for the flags they were built with so each flag set gets its own cache
+        std::stringstream cache;
+        cache << options.output << "/.modules/" << std::hex << std::hash<std::string>{}(key) << "/";
+
+        fs::create_directories(cache.str());
+
+        return fs::absolute(cache.str()).string();
+    }
+
+    ModuleUnit Binary::scanModule(const std::string& source, const std::string& cache) {
+        ModuleUnit unit;
+        unit.source = source;
+
+        std::string name = cache + sanitize(source);
+        std::string ddi = name + ".ddi";
+        unit.object = name + ".o";
+
+        if (isNewer(ddi, source) && parseP1689(readFile(ddi), unit))
+            return unit;
+
+        std::stringstream command;
+
+        if (!options.compiler.scanner.empty()) {
+            command << options.compiler.scanner << " -format=p1689 -- ";
+            command << options.compiler.alias << " ";
+            command << compileFlags();
+            command << options.compiler.languageFlag << " " << source << " ";
+            command << options.compiler.compileFlag << " ";
+            command << options.compiler.outputFlag << unit.object << " ";
+            command << "> " << ddi << " 2> /dev/null";
+        } else if (options.compiler.toolchain.supports(options.compiler.scanFlag)) {
+            command << options.compiler.alias << " ";
+            command << compileFlags();
+            command << options.compiler.moduleFlag << " ";
+            command << options.compiler.languageFlag << " " << source << " -E ";
+            command << options.compiler.depFileFlag << name << ".d ";
+            command << options.compiler.scanFlag << " ";
+            command << options.compiler.scanFileFlag << ddi << " ";
+            command << options.compiler.scanTargetFlag << unit.object << " ";
+            command << options.compiler.outputFlag << "/dev/null ";
+            command << "> /dev/null 2>&1";
+        }
+
+        if (!command.str().empty() && system(command.str().c_str()) == 0 && parseP1689(readFile(ddi), unit))
+            return unit;
+
+        unit.imports.clear();
+        scanSource(source, unit);
+
+        return unit;
+    }
+
+    std::string Binary::resolveHeader(const std::string& header, const std::string& cache) {
+        std::string deps = cache + sanitize(header) + ".d";
+        bool current = fs::exists(deps);
+
+        // the header may live elsewhere once anything it includes moves or changes
+        for (auto& input : current ? parseDepfile(deps) : std::vector<std::string>()) {
+            if (!fs::exists(input) || fs::last_write_time(input) > fs::last_write_time(deps)) {
+                current = false;
+                break;
+            }
+        }
+
+        if (!current) {
+            std::stringstream command;
+            command << "echo '#include <" << header << ">' | ";
+            command << options.compiler.alias << " ";
+            command << compileFlags();
+            command << options.compiler.languageFlag << " -M - ";
+            command << "> " << deps << " 2> /dev/null";
+
+            if (system(command.str().c_str())) {
+                fs::remove(deps);
+                return "";
+            }
+        }
+
+        std::stringstream tokens(readFile(deps));
+        std::string token;
+
+        while (tokens >> token) {
+            if (token.size() > header.size() && token.compare(token.size() - header.size() - 1, std::string::npos, "/" + header) == 0)
+                return token;
+        }
+
+        return "";
+    }
+
+    int Binary::compileModules(std::string& flags, std::vector<std::string>& objects, std::vector<std::string>& headerFiles) {
+        std::string cache = moduleCache();
+        std::string mapperPath = cache + "module.map";
+
+        // gcc reads BMI locations from a mapper file, clang looks imports up by name in the cache
+        std::stringstream moduleFlags;
+        moduleFlags << options.compiler.moduleFlag << " ";
+
+        if (!options.compiler.moduleMapperFlag.empty())
+            moduleFlags << options.compiler.moduleMapperFlag << mapperPath << " ";
+
+        if (!options.compiler.modulePathFlag.empty())
+            moduleFlags << options.compiler.modulePathFlag << cache << " ";
+
+        std::string base = options.compiler.alias + " " + compileFlags();
+
+        std::vector<ModuleUnit> units(modules.size());
+        std::vector<std::string> headerPaths(headerUnits.size());
+        std::vector<Job> scans;
+
+        for (size_t i = 0; i < modules.size(); i++)
+            scans.push_back(Job{"", {}, [&, i]() { units[i] = scanModule(modules[i], cache); return 0; }});
+
+        for (size_t i = 0; i < headerUnits.size(); i++)
+            scans.push_back(Job{"", {}, [&, i]() { headerPaths[i] = resolveHeader(headerUnits[i], cache); return 0; }});
+
+        runJobs(scans, options.jobs);
+
+        std::unordered_map<std::string, std::string> bmis;
+        std::stringstream mapper;
+        mapper << "$root " << cache << "\n";
+
+        for (auto& unit : units) {
+            if (unit.provides.empty())
+                continue;
+
+            if (bmis.find(unit.provides) != bmis.end()) {
+                printf("Module '%s' is provided by more than one source\n", unit.provides.c_str());
+                return -1;
+            }
+
+            unit.bmi = cache + moduleFileName(unit.provides) + options.compiler.moduleExtension;
+            bmis[unit.provides] = unit.bmi;
+            mapper << unit.provides << " " << fs::path(unit.bmi).filename().string() << "\n";
+        }
+
+        std::vector<Job> headerJobs;
+        std::stringstream headerFlags;
+
+        for (size_t i = 0; i < headerUnits.size(); i++) {
+            if (headerPaths[i].empty()) {
+                printf("Failed to find header unit <%s>\n", headerUnits[i].c_str());
+                return -1;
+            }
+
+            std::string bmi = sanitize(headerUnits[i]) + options.compiler.moduleExtension;
+            mapper << headerPaths[i] << " " << bmi << "\n";
+
+            std::stringstream command;
+            command << base << moduleFlags.str();
+
+            // only gcc picks the header unit's BMI location from the mapper
+            if (options.compiler.moduleFileFlag.empty())
+                command << options.compiler.compileFlag << " " << options.compiler.headerUnitFlag << " " << headerUnits[i];
+            else
+                command << options.compiler.headerUnitFlag << " " << headerUnits[i] << " " << options.compiler.outputFlag << cache << bmi;
+
+            if (!options.compiler.moduleFileFlag.empty())
+                headerFlags << options.compiler.moduleFileFlag << cache << bmi << " ";
+
+            headerFiles.push_back(cache + bmi);
+
+            // tracked like any other unit so edits to the headers it pulls in rebuild it
+            headerJobs.push_back(Job{"", {}, [this, output = cache + bmi, command = command.str()]() {
+                std::string toolchain = toolchainId(options.compiler.toolchain);
+                std::vector<std::string> reasons = recordReasons(output, output, command, toolchain, {});
+
+                if (reasons.empty())
+                    return 0;
+
+                return compileUnit(output, command, options.compiler.depFileFlag, toolchain, {}, reasons);
+            }});
+        }
+
+        moduleFlags << headerFlags.str();
+
+        if (!options.compiler.moduleMapperFlag.empty() && readFile(mapperPath) != mapper.str()) {
+            std::ofstream mapperFile(mapperPath);
+            mapperFile << mapper.str();
+        }
+
+        int ret = runJobs(headerJobs, options.jobs);
+
+        if (ret)
+            return ret;
+
+        std::vector<Job> moduleJobs;
+
+        for (auto& unit : units) {
+            std::stringstream command;
+            command << base << moduleFlags.str();
+            command << (unit.provides.empty() ? options.compiler.languageFlag : options.compiler.moduleLanguageFlag) << " " << unit.source << " ";
+            command << options.compiler.compileFlag << " ";
+            command << options.compiler.outputFlag << unit.object;
+
+            if (!unit.provides.empty() && !options.compiler.moduleOutputFlag.empty())
+                command << " " << options.compiler.moduleOutputFlag << unit.bmi;
+
+            // interfaces are ordered by their imports, dependents run as soon as their last import lands
+            moduleJobs.push_back(Job{unit.provides, unit.imports, [this, &unit, &bmis, command = command.str()]() {
+                std::string toolchain = toolchainId(options.compiler.toolchain);
+                std::vector<std::string> imported;
+
+                for (auto& import : unit.imports) {
+                    auto it = bmis.find(import);
+
+                    if (it != bmis.end() && it->second != unit.bmi)
+                        imported.push_back(it->second);
+                }
+
+                std::vector<std::string> reasons = recordReasons(unit.object, unit.object, command, toolchain, imported);
+
+                if (reasons.empty() && !unit.bmi.empty() && !fs::exists(unit.bmi))
+                    reasons.push_back(unit.bmi + " does not exist");
+
+                if (reasons.empty())
+                    return 0;
+
+                return compileUnit(unit.object, command, options.compiler.depFileFlag, toolchain, imported, reasons);
+            }});
+
+            objects.push_back(unit.object);
+        }
+
+        ret = runJobs(moduleJobs, options.jobs);
+
+        if (ret)
+            return ret;
+
+        flags = moduleFlags.str();
+
+        return 0;
+    }
+}
@@ -0,0 +1,431 @@
+#include <cbuild/cbuild.hpp>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <unordered_map>
+#include <algorithm>
+#include <unistd.h>
+namespace fs = std::filesystem;
+
+namespace CBuild {
+
+    struct Probe {
+        std::string flag;
+        std::string args; // "{out}" is replaced by the probe's output stem
+        bool link;
+    };
+
+    // bump when the cache layout changes so older caches are probed again
+    static const int cacheVersion = 3;
+
+    static const std::vector<std::string> packagerProbes = {
+        "llvm-dwp",
+        "dwp",
+    };
+
+    static const std::vector<std::string> linkerProbes = {
+        "-fuse-ld=mold",
+        "-fuse-ld=lld",
+        "-fuse-ld=gold",
+    };
+
+    static const std::vector<Probe> flagProbes = {
+        {"-fmodules-ts",          "-std=c++20 -fmodules-ts -c", false},
+        {"-fdeps-format=p1689r5", "-std=c++20 -fmodules-ts -E -MD -MF {out}.d -fdeps-format=p1689r5 -fdeps-file={out}.ddi -fdeps-target={out}.o", false},
+        {"-gsplit-dwarf",         "-g -gsplit-dwarf -c", false},
+        {"-ftime-trace",          "-ftime-trace -c", false},
+        {"-gz",                   "-g -gz", true},
+        {"-Wl,--gdb-index",       "-g -Wl,--gdb-index", true},
+        {"-Wl,--compress-debug-sections=zlib", "-g -Wl,--compress-debug-sections=zlib", true},
+        {"-flto=auto",            "-flto=auto", true},
+    };
+
+    bool Toolchain::supports(const std::string& flag) const {
+        return std::find(flags.begin(), flags.end(), flag) != flags.end();
+    }
+
+    static fs::path cacheDirectory() {
+        if (const char* xdg = getenv("XDG_CACHE_HOME"))
+            return fs::path(xdg) / "cbuild";
+
+        if (const char* home = getenv("HOME"))
+            return fs::path(home) / ".cache" / "cbuild";
+
+        return fs::absolute(CBUILD_DIR);
+    }
+
+    static fs::path findExecutable(const std::string& alias) {
+        if (alias.find('/') != std::string::npos)
+            return fs::exists(alias) ? fs::canonical(alias) : fs::path();
+
+        const char* path = getenv("PATH");
+
+        if (!path)
+            return fs::path();
+
+        std::stringstream directories(path);
+        std::string directory;
+
+        while (std::getline(directories, directory, ':')) {
+            fs::path candidate = fs::path(directory) / alias;
+
+            if (!directory.empty() && fs::is_regular_file(candidate))
+                return fs::canonical(candidate);
+        }
+
+        return fs::path();
+    }
+
+    std::string hashFile(const std::string& path) {
+        std::ifstream file(path, std::ios::binary);
+        std::vector<char> buffer(1 << 16);
+        uint64_t hash = 14695981039346656037ull;
+
+        while (file.read(buffer.data(), buffer.size()) || file.gcount() > 0) {
+            for (std::streamsize i = 0; i < file.gcount(); i++) {
+                hash ^= (unsigned char)buffer[i];
+                hash *= 1099511628211ull;
+            }
+        }
+
+        std::stringstream hex;
+        hex << std::hex << hash;
+        return hex.str();
+    }
+
+    static std::string probeKey() {
+        std::string key = std::to_string(cacheVersion) + ";";
+
+        for (auto& packager : packagerProbes)
+            key += packager + ";";
+
+        for (auto& linker : linkerProbes)
+            key += linker + ";";
+
+        for (auto& probe : flagProbes)
+            key += probe.flag + probe.args + (probe.link ? "1" : "0") + ";";
+
+        std::stringstream hex;
+        hex << std::hex << std::hash<std::string>{}(key);
+        return hex.str();
+    }
+
+    static int runProbe(const Toolchain& toolchain, const fs::path& dir, size_t index, const std::string& args, const std::string& source = "probe.cpp") {
+        std::string out = (dir / ("probe" + std::to_string(index))).string();
+        std::string expanded = args;
+
+        for (size_t pos; (pos = expanded.find("{out}")) != std::string::npos;)
+            expanded.replace(pos, 5, out);
+
+        std::stringstream command;
+        command << toolchain.path << " -x c++ " << (dir / source).string() << " ";
+        command << expanded << " -Werror -o " << out << ".out ";
+        command << "> /dev/null 2>&1";
+
+        return system(command.str().c_str());
+    }
+
+    static void identify(Toolchain& toolchain, const fs::path& dir) {
+        fs::path macros = dir / "macros.txt";
+
+        std::stringstream command;
+        command << toolchain.path << " -dM -E -x c++ /dev/null > " << macros.string() << " 2> /dev/null";
+
+        if (system(command.str().c_str()))
+            return;
+
+        std::ifstream file(macros);
+        std::string define, name, value;
+        std::unordered_map<std::string, int> values;
+
+        while (file >> define >> name && std::getline(file, value)) {
+            if (name.rfind("__clang", 0) == 0 || name.rfind("__GNUC", 0) == 0)
+                values[name] = atoi(value.c_str());
+        }
+
+        if (values.count("__clang__")) {
+            toolchain.family = CompilerFamily::eClang;
+            toolchain.major = values["__clang_major__"];
+            toolchain.minor = values["__clang_minor__"];
+            toolchain.patch = values["__clang_patchlevel__"];
+        } else if (values.count("__GNUC__")) {
+            toolchain.family = CompilerFamily::eGcc;
+            toolchain.major = values["__GNUC__"];
+            toolchain.minor = values["__GNUC_MINOR__"];
+            toolchain.patch = values["__GNUC_PATCHLEVEL__"];
+        }
+
+        if (toolchain.family == CompilerFamily::eClang) {
+            fs::path sibling = fs::path(toolchain.path).parent_path() / "clang-scan-deps";
+            fs::path found = fs::exists(sibling) ? sibling : findExecutable("clang-scan-deps");
+
+            toolchain.scanner = found.string();
+        }
+    }
+
+    // some dwp builds crash on newer DWARF so each candidate has to package a real split binary
+    static void findPackager(Toolchain& toolchain, const fs::path& dir) {
+        size_t index = linkerProbes.size() + flagProbes.size();
+        std::string binary = (dir / ("probe" + std::to_string(index) + ".out")).string();
+
+        // an empty main has too little debug info to trip a packager up, the standard containers have plenty
+        std::ofstream source(dir / "package.cpp");
+        source << "#include <string>\n#include <vector>\n";
+        source << "int main(int argc, char** argv) { std::vector<std::string> args(argv, argv + argc); return (int)args.size(); }\n";
+        source.close();
+
+        // linked with the same flags as an ePackaged build
+        std::string args = "-g -gsplit-dwarf";
+
+        if (toolchain.supports("-Wl,--gdb-index") || toolchain.supports("-Wl,--compress-debug-sections=zlib"))
+            args += " " + toolchain.linker;
+
+        if (toolchain.supports("-Wl,--gdb-index"))
+            args += " -Wl,--gdb-index";
+
+        if (toolchain.supports("-Wl,--compress-debug-sections=zlib"))
+            args += " -Wl,--compress-debug-sections=zlib";
+
+        if (runProbe(toolchain, dir, index, args, "package.cpp"))
+            return;
+
+        for (auto& candidate : packagerProbes) {
+            fs::path sibling = fs::path(toolchain.path).parent_path() / candidate;
+            fs::path packager = fs::exists(sibling) ? sibling : findExecutable(candidate);
+
+            if (packager.empty())
+                continue;
+
+            std::stringstream command;
+            command << packager.string() << " -e " << binary << " -o " << binary << ".dwp > /dev/null 2>&1";
+
+            if (system(command.str().c_str()) == 0) {
+                toolchain.packager = packager.string();
+                return;
+            }
+        }
+    }
+
+    static void probe(Toolchain& toolchain, const fs::path& dir) {
+        fs::create_directories(dir);
+
+        std::ofstream source(dir / "probe.cpp");
+        source << "int main() { return 0; }\n";
+        source.close();
+
+        identify(toolchain, dir);
+
+        std::vector<char> linkerWorks(linkerProbes.size(), false);
+        std::vector<Job> jobs;
+
+        for (size_t i = 0; i < linkerProbes.size(); i++)
+            jobs.push_back(Job{"", {}, [&, i]() { linkerWorks[i] = runProbe(toolchain, dir, i, linkerProbes[i]) == 0; return 0; }});
+
+        runJobs(jobs);
+
+        // the probe order doubles as the preference order
+        for (size_t i = 0; i < linkerProbes.size(); i++) {
+            if (linkerWorks[i])
+                toolchain.linkers.push_back(linkerProbes[i]);
+        }
+
+        if (!toolchain.linkers.empty())
+            toolchain.linker = toolchain.linkers[0];
+
+        std::vector<char> flagWorks(flagProbes.size(), false);
+        jobs.clear();
+
+        for (size_t i = 0; i < flagProbes.size(); i++) {
+            std::string args = flagProbes[i].args;
+
+            // link probes run with the chosen linker so linker only flags are judged by it
+            if (flagProbes[i].link)
+                args += " " + toolchain.linker;
+
+            jobs.push_back(Job{"", {}, [&, i, args]() { flagWorks[i] = runProbe(toolchain, dir, linkerProbes.size() + i, args) == 0; return 0; }});
+        }
+
+        runJobs(jobs);
+
+        for (size_t i = 0; i < flagProbes.size(); i++) {
+            if (flagWorks[i])
+                toolchain.flags.push_back(flagProbes[i].flag);
+        }
+
+        if (toolchain.supports("-gsplit-dwarf"))
+            findPackager(toolchain, dir);
+
+        fs::remove_all(dir);
+    }
+
+    static std::unordered_map<std::string, std::string> readCache(const fs::path& path) {
+        std::unordered_map<std::string, std::string> entries;
+        std::ifstream file(path);
+        std::string line;
+
+        while (std::getline(file, line)) {
+            size_t split = line.find('=');
+
+            if (split == std::string::npos)
+                continue;
+
+            std::string key = line.substr(0, split);
+            std::string value = line.substr(split + 1);
+
+            // repeated keys are kept as a semicolon separated list
+            if (entries.find(key) != entries.end())
+                entries[key] += ";" + value;
+            else
+                entries[key] = value;
+        }
+
+        return entries;
+    }
+
+    static std::vector<std::string> splitList(const std::string& list) {
+        std::vector<std::string> values;
+        std::stringstream stream(list);
+        std::string value;
+
+        while (std::getline(stream, value, ';')) {
+            if (!value.empty())
+                values.push_back(value);
+        }
+
+        return values;
+    }
+
+    static void writeCache(const fs::path& path, const Toolchain& toolchain, const std::string& mtime, const std::string& size, const std::string& hash) {
+        fs::create_directories(path.parent_path());
+
+        // each process writes its own file, a shared one could be truncated by another build mid rename
+        fs::path temp = path.string() + "." + std::to_string(getpid()) + ".tmp";
+        std::ofstream file(temp);
+
+        file << "path=" << toolchain.path << "\n";
+        file << "mtime=" << mtime << "\n";
+        file << "size=" << size << "\n";
+        file << "hash=" << hash << "\n";
+        file << "probes=" << probeKey() << "\n";
+        file << "family=" << (int)toolchain.family << "\n";
+        file << "version=" << toolchain.major << "." << toolchain.minor << "." << toolchain.patch << "\n";
+        file << "scanner=" << toolchain.scanner << "\n";
+        file << "packager=" << toolchain.packager << "\n";
+        file << "linker=" << toolchain.linker << "\n";
+
+        for (auto& linker : toolchain.linkers)
+            file << "linkers=" << linker << "\n";
+
+        for (auto& flag : toolchain.flags)
+            file << "flag=" << flag << "\n";
+
+        file.close();
+
+        // renamed into place so concurrent builds never read a half written cache
+        fs::rename(temp, path);
+    }
+
+    static Toolchain loadCache(std::unordered_map<std::string, std::string>& entries) {
+        Toolchain toolchain;
+        toolchain.path = entries["path"];
+        toolchain.hash = entries["hash"];
+        toolchain.family = (CompilerFamily)atoi(entries["family"].c_str());
+        sscanf(entries["version"].c_str(), "%d.%d.%d", &toolchain.major, &toolchain.minor, &toolchain.patch);
+        toolchain.scanner = entries["scanner"];
+        toolchain.packager = entries["packager"];
+        toolchain.linker = entries["linker"];
+        toolchain.linkers = splitList(entries["linkers"]);
+        toolchain.flags = splitList(entries["flag"]);
+        return toolchain;
+    }
+
+    Toolchain probeToolchain(const std::string& alias) {
+        static std::mutex mutex;
+        static std::unordered_map<std::string, Toolchain> probed;
+
+        std::lock_guard<std::mutex> guard(mutex);
+
+        if (probed.find(alias) != probed.end())
+            return probed[alias];
+
+        Toolchain toolchain;
+
+        // launchers like 'ccache g++' come first, the compiler is the last word before any flag
+        std::stringstream words(alias);
+        std::string word, compiler;
+
+        while (words >> word && word[0] != '-')
+            compiler = word;
+
+        fs::path binary = findExecutable(compiler);
+
+        // remembered so the warning is printed once, the compile still runs without probed capabilities
+        if (binary.empty()) {
+            printf("Failed to find compiler '%s'\n", alias.c_str());
+            probed[alias] = toolchain;
+            return toolchain;
+        }
+
+        std::string mtime = std::to_string(fs::last_write_time(binary).time_since_epoch().count());
+        std::string size = std::to_string(fs::file_size(binary));
+
+        std::stringstream name;
+        name << std::hex << std::hash<std::string>{}(binary.string());
+        fs::path cachePath = cacheDirectory() / "toolchains" / name.str();
+
+        auto entries = readCache(cachePath);
+        bool current = entries["path"] == binary.string() && entries["probes"] == probeKey();
+
+        // the binary is only hashed when its timestamp moved, an unchanged compiler costs one stat
+        if (current && entries["mtime"] == mtime && entries["size"] == size) {
+            toolchain = loadCache(entries);
+        } else {
+            std::string hash = hashFile(binary);
+
+            if (current && entries["hash"] == hash) {
+                toolchain = loadCache(entries);
+            } else {
+                toolchain.path = binary.string();
+                toolchain.hash = hash;
+                probe(toolchain, cacheDirectory() / "toolchains" / (name.str() + "." + std::to_string(getpid()) + ".probe"));
+            }
+
+            writeCache(cachePath, toolchain, mtime, size, hash);
+        }
+
+        probed[alias] = toolchain;
+
+        return toolchain;
+    }
+
+    Compiler detectCompiler(std::string alias) {
+        Compiler compiler;
+        compiler.alias = alias;
+        compiler.toolchain = probeToolchain(alias);
+
+        Toolchain& toolchain = compiler.toolchain;
+
+        if (!toolchain.linker.empty())
+            compiler.add += " " + toolchain.linker;
+
+        if (toolchain.family == CompilerFamily::eClang) {
+            // clang warns about the linker flags in 'add' whenever it only compiles
+            compiler.add += " -Wno-unused-command-line-argument";
+            compiler.scanner = toolchain.scanner;
+
+            // clang 16 writes the BMI alongside the object and finds imports by name in one directory
+            if (toolchain.major >= 16) {
+                compiler.moduleFlag = "";
+                compiler.moduleMapperFlag = "";
+                compiler.modulePathFlag = "-fprebuilt-module-path=";
+                compiler.moduleOutputFlag = "-fmodule-output=";
+                compiler.moduleFileFlag = "-fmodule-file=";
+                compiler.moduleLanguageFlag = "-x c++-module";
+                compiler.headerUnitFlag = "--precompile -xc++-system-header";
+                compiler.moduleExtension = ".pcm";
+            }
+        }
+
+        return compiler;
+    }
+}